@@ -0,0 +1,70 @@
+#ifndef CULLING_H
+#define CULLING_H
+
+#include "ray.h"
+#include "vec3.h"
+#include "view.h"
+#include "world.h"
+
+#include <algorithm>
+#include <ranges>
+#include <span>
+#include <vector>
+
+// Objects that the camera rays of each screen tile may hit, found by testing
+// their bounding spheres against the tile's frustum. Tiles that see nothing
+// get an empty list, so their rays skip intersection entirely.
+struct TileCulling
+{
+    static constexpr unsigned Tile = 16;
+
+    void build(const View& view, const World& world) {
+        columns = (Width + Tile - 1) / Tile;
+        const auto rows = (Height + Tile - 1) / Tile;
+        first.assign(1, 0);
+        indices.clear();
+
+        auto dir = [&view](double X, double Y) {
+            return view.pixelUL + X * view.pixelDX + Y * view.pixelDY - view.origin;
+        };
+
+        for (auto ty : std::views::iota(0u, rows)) {
+            for (auto tx : std::views::iota(0u, columns)) {
+                // Tile edges, widened by the half pixel that rays are jittered.
+                const double x0 = tx * Tile - 0.5, x1 = std::min((tx + 1) * Tile, Width) - 0.5;
+                const double y0 = ty * Tile - 0.5, y1 = std::min((ty + 1) * Tile, Height) - 0.5;
+                const vec3 corners[4] {dir(x0, y0), dir(x1, y0), dir(x1, y1), dir(x0, y1)};
+                const auto middle = corners[0] + corners[1] + corners[2] + corners[3];
+
+                // Inward normals of the four side planes through the camera.
+                vec3 planes[4];
+                for (auto k : std::views::iota(0, 4)) {
+                    planes[k] = cross(corners[k], corners[(k + 1) % 4]).normalize();
+                    if (planes[k].dot(middle) < 0)
+                        planes[k] = -planes[k];
+                }
+
+                for (auto i : std::views::iota(0u, unsigned(world.objects.size()))) {
+                    const auto& o = world.objects[i];
+                    const auto c = o->center - view.origin;
+                    if (std::ranges::all_of(planes, [&](const auto& n) { return n.dot(c) >= -o->extent(); }))
+                        indices.push_back(i);
+                }
+
+                first.push_back(indices.size());
+            }
+        }
+    }
+
+    std::span<const unsigned> candidates(unsigned x, unsigned y) const {
+        const auto t = y / Tile * columns + x / Tile;
+        return {indices.data() + first[t], indices.data() + first[t + 1]};
+    }
+
+private:
+    unsigned columns = 0;
+    std::vector<unsigned> first; // Start of each tile's list in indices, then the end
+    std::vector<unsigned> indices;
+};
+
+#endif // CULLING_H
@@ -3,7 +3,10 @@ constexpr double   Aspect = 16.0 / 9.0;
 constexpr unsigned Height = Width / Aspect;
 
 #include "color.h"
+#include "culling.h"
 #include "object.h"
+#include "output.h"
+#include "radiance.h"
 #include "ray.h"
 #include "renderer.h"
 #include "vec3.h"
@@ -18,36 +21,83 @@ constexpr unsigned Height = Width / Aspect;
 
 #include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <cstdlib>
 #include <cstring>
+#include <future>
 #include <iostream>
+#include <limits>
+#include <optional>
 #include <ranges>
+#include <string_view>
 #include <thread>
 #include <utility>
+#include <vector>
+
+// First surface seen along a pixel's center ray.
+struct Surface
+{
+    double depth = std::numeric_limits<double>::infinity(); // Infinite for sky
+    bool diffuse = true; // Looks alike from any viewpoint, unlike metal or glass
+};
 
 static View Camera;
 static World world;
 static int threads = 4;
 static int SamplesPerPixel = 20;
-static int SamplesPerPixelTmp = 20;
+static bool Budgeted = false;
+static float Budget = 5.f;
 static float Daylight = 0.5f;
+static bool Caching = false;
+static int CacheQuality = 4;
+static RadianceCache cache;
+static TileCulling tiles;
+static ToneMap Tone;
+static std::vector<std::future<void>> exports;
 static Renderer renderer;
+static constexpr unsigned HistoryCap = 32;
+static bool Reusable = false; // Last image may be reprojected by preview()
+static bool Edited = false; // Scene changed since the last render started
+static View LastCamera;
+static std::vector<Surface> Surfaces; // Seen by LastCamera's pixels
 static std::chrono::time_point<std::chrono::high_resolution_clock> renderStart;
 static std::chrono::duration<double> renderTime;
 
-static color ray_color(const ray& r, int depth = 50);
-static void initiateRender(SDL_Surface *canvas);
-static void showObjectControls(int index, std::unique_ptr<Object>& o);
+static constexpr int MaxDepth = 50;
+
+static color ray_color(const ray& r, int depth = MaxDepth, std::optional<unsigned> from = {});
+static color shade(const ray& r, const std::optional<World::Hit>& hit, int depth);
+static color samplePixel(unsigned x, unsigned y);
+static void initiateRender(SDL_Surface *canvas, bool quick = false);
+static bool showObjectControls(int index, std::unique_ptr<Object>& o);
 static void showCameraControls(SDL_Surface *canvas);
 static void addRandomObject();
 static void preview(SDL_Surface *canvas);
+static void prepareScene();
+static void sceneChanged();
 static void exportScreenshot(SDL_Surface *canvas);
+static void recordSurface(unsigned x, unsigned y);
+static void reprojectHistory(std::vector<Surface> previous);
+static int renderHeadless(std::string_view mode, const char *arg);
+static int reportScaling(unsigned spp);
 
-int main()
+int main(int argc, char *argv[])
 {
+    world.add<Sphere>(point3(0.00, -100.50, -1.0), 100.0,
+        Material::Lambertian, color(0.5, 1.0, 0.5));
+    for (auto i : std::views::iota(0, 10))
+        addRandomObject();
+
+    if (argc == 3)
+        return renderHeadless(argv[1], argv[2]);
+
     SDL_Init(SDL_INIT_VIDEO);
     IMG_Init(IMG_INIT_PNG);
     auto window = SDL_CreateWindow("raytrace", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, Width, Height, SDL_WINDOW_RESIZABLE);
-    auto canvas = SDL_CreateRGBSurfaceWithFormat(0, Width, Height, 32, SDL_PIXELFORMAT_RGBA8888);
+    // Left untouched so that pages land on the nodes of the workers writing them.
+    Untouched<std::uint32_t> pixels (Width * Height);
+    auto canvas = SDL_CreateRGBSurfaceWithFormatFrom(pixels.get(), Width, Height, 32,
+        Width * sizeof(std::uint32_t), SDL_PIXELFORMAT_RGBA8888);
     auto painter = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC /*| SDL_RENDERER_ACCELERATED*/);
     auto tex = SDL_CreateTextureFromSurface(painter, canvas);
     bool run = true;
@@ -56,11 +106,6 @@ int main()
     ImGui_ImplSDL2_InitForSDLRenderer(window, painter);
     ImGui_ImplSDLRenderer2_Init(painter);
 
-    world.add<Sphere>(point3(0.00, -100.50, -1.0), 100.0,
-        Material::Lambertian, color(0.5, 1.0, 0.5));
-    for (auto i : std::views::iota(0, 10))
-        addRandomObject();
-
     initiateRender(canvas);
     for (SDL_Event event; run;) {
         while (SDL_PollEvent(&event)) {
@@ -82,10 +127,36 @@ int main()
         if (ImGui::InputInt("T", &threads))
             threads = std::max(threads, 1);
         showCameraControls(canvas);
-        if (ImGui::SliderInt("samples", &SamplesPerPixel, 1, 200)) {
-            SamplesPerPixelTmp = SamplesPerPixel;
+        ImGui::Checkbox("budget", &Budgeted);
+        ImGui::SameLine();
+        // CTRL+click lets sliders go out of range.
+        if (Budgeted) {
+            if (ImGui::SliderFloat("seconds", &Budget, 0.1f, 60.f, "%.1f"))
+                Budget = std::max(Budget, 0.1f);
+        } else {
+            if (ImGui::SliderInt("samples", &SamplesPerPixel, 1, 200))
+                SamplesPerPixel = std::max(SamplesPerPixel, 1);
+        }
+        if (ImGui::SliderFloat("shade", &Daylight, 0.25f, 1.f))
+            sceneChanged();
+        ImGui::Checkbox("cache", &Caching);
+        if (Caching) {
+            ImGui::SameLine();
+            if (ImGui::SliderInt("quality", &CacheQuality, 1, 8))
+                cache.setQuality(CacheQuality);
+        }
+
+        bool toned = ImGui::SliderFloat("exposure", &Tone.exposure, 0.1f, 4.f, "%.2f");
+        ImGui::SameLine(); ImGui::SetNextItemWidth(100);
+        toned |= ImGui::Combo("curve", reinterpret_cast<int *>(&Tone.curve), "sRGB\0gamma 2\0");
+        ImGui::SameLine();
+        toned |= ImGui::Checkbox("ACES", &Tone.aces);
+        if (toned) {
+            renderer.setToneMap(Tone);
+            renderer.develop();
+            SDL_DestroyTexture(tex);
+            tex = SDL_CreateTextureFromSurface(painter, canvas);
         }
-        ImGui::SliderFloat("shade", &Daylight, 0.25f, 1.f);
 
         if (ImGui::Button("recalculate"))
             initiateRender(canvas);
@@ -110,23 +181,41 @@ int main()
             SDL_DestroyTexture(tex);
             tex = SDL_CreateTextureFromSurface(painter, canvas);
             renderTime = std::chrono::high_resolution_clock::now() - renderStart;
-            SamplesPerPixel = SamplesPerPixelTmp;
         } else {
-            ImGui::Text("%0.6lfs", renderTime.count());
+            if (renderer.mostSamples() > renderer.samples())
+                ImGui::Text("%0.6lfs, %u-%u spp", renderTime.count(), renderer.samples(), renderer.mostSamples());
+            else
+                ImGui::Text("%0.6lfs, %u spp", renderTime.count(), renderer.samples());
+            if (const auto over = renderer.overrun(); over.count() > 0) {
+                ImGui::SameLine();
+                ImGui::Text("(%0.2lfs over budget)", over.count());
+            }
         }
+        ImGui::Text("culled: %lu camera rays, %lu bounce rays",
+            CullStats::primary(), CullStats::bounce());
         ImGui::End();
 
         ImGui::Begin("balls", nullptr, ImGuiWindowFlags_NoResize);
+        bool edited = false;
         std::ranges::for_each(
             std::views::zip(std::views::iota(0), std::views::drop(world.objects, 1)),
-            [](auto io) { std::apply(showObjectControls, io); });
+            [&edited](auto io) { edited |= std::apply(showObjectControls, io); });
+        if (edited) {
+            renderer.stop();
+            sceneChanged();
+            preview(canvas);
+        }
 
         if (ImGui::Button("add")) {
+            renderer.stop();
             addRandomObject();
+            sceneChanged();
             initiateRender(canvas);
         }
         if (ImGui::Button("del")) {
+            renderer.stop();
             world.objects.pop_back();
+            sceneChanged();
             initiateRender(canvas);
         }
         ImGui::End();
@@ -140,6 +229,9 @@ int main()
         std::this_thread::sleep_for(std::chrono::milliseconds(30));
     }
 
+    for (auto& e : exports)
+        e.wait();
+
     ImGui_ImplSDLRenderer2_Shutdown();
     ImGui_ImplSDL2_Shutdown();
     ImGui::DestroyContext();
@@ -150,15 +242,35 @@ int main()
     SDL_Quit();
 }
 
-color ray_color(const ray& r, int depth)
+color ray_color(const ray& r, int depth, std::optional<unsigned> from)
 {
     if (depth <= 0)
         return {};
 
-    if (auto hit = world.hit(r); hit) {
-        const auto& [closest, object] = *hit;
+    return shade(r, world.hit(r, from), depth);
+}
+
+color shade(const ray& r, const std::optional<World::Hit>& hit, int depth)
+{
+    if (hit) {
+        const auto& [closest, object, index] = *hit;
+
+        // Diffuse bounces past the first hit may use cached incoming light
+        // instead of tracing the rest of the path.
+        if (Caching && depth < MaxDepth && object->M == Material::Lambertian) {
+            const auto p = r.at(closest);
+            const auto key = cache.key(p, object->normal(p));
+            if (const auto light = cache.lookup(key); light)
+                return object->tint * *light;
+
+            const auto [atten, scat] = object->scatter(r, closest);
+            const auto light = ray_color(scat, depth - 1, object->escapes(scat) ? std::optional(index) : std::nullopt);
+            cache.record(key, light);
+            return atten * light;
+        }
+
         const auto [atten, scat] = object->scatter(r, closest);
-        return atten * ray_color(scat, depth - 1);
+        return atten * ray_color(scat, depth - 1, object->escapes(scat) ? std::optional(index) : std::nullopt);
     } else {
         const auto unitDir = r.direction().normalize();
         const auto a = Daylight * (unitDir.y() + 1.0);
@@ -166,46 +278,66 @@ color ray_color(const ray& r, int depth)
     }
 }
 
-void initiateRender(SDL_Surface *canvas)
+color samplePixel(unsigned x, unsigned y)
+{
+    const auto r = Camera.getRay(x, y, true);
+    return shade(r, world.hit(r, tiles.candidates(x, y)), MaxDepth);
+}
+
+void initiateRender(SDL_Surface *canvas, bool quick)
 {
     if (renderer)
         renderer.stop();
 
+    // Workers of the stopped render may have cached light of the old scene.
+    if (std::exchange(Edited, false))
+        cache.clear();
+
     renderTime = std::chrono::duration<double>::zero();
 
-    auto func = [format = canvas->format](auto x, auto y) {
-        auto col = std::ranges::fold_left(std::views::iota(0, SamplesPerPixel), color(),
-            [y, x](color c, int i) { return c + ray_color(Camera.getRay(x, y, true)); });
+    prepareScene();
+    renderer.setBuffer((uint32_t *)canvas->pixels, Width, Height);
 
-        col = col / SamplesPerPixel * 255;
-        return SDL_MapRGB(format, col.x(), col.y(), col.z());
-    };
+    // Every render records what its pixels see, so that the next preview can
+    // reuse its image; only previews reuse the image before them.
+    auto previous = std::exchange(Surfaces, std::vector<Surface>(Width * Height));
+    renderer.survey(recordSurface);
+    if (quick && Reusable)
+        reprojectHistory(std::move(previous));
+    LastCamera = Camera;
+    Reusable = true;
 
-    Camera.recalculate();
-    renderer.setBuffer((uint32_t *)canvas->pixels, Width, Height);
     renderStart = std::chrono::high_resolution_clock::now();
-    renderer.start(func, threads);
+    if (quick)
+        renderer.start(samplePixel, threads, 1u);
+    else if (Budgeted)
+        renderer.start(samplePixel, threads, std::chrono::duration<double>(Budget));
+    else
+        renderer.start(samplePixel, threads, unsigned(SamplesPerPixel));
 }
 
-void showObjectControls(int index, std::unique_ptr<Object>& o)
+// Returns whether the object was edited.
+bool showObjectControls(int index, std::unique_ptr<Object>& o)
 {
     const auto idx = std::to_string(index);
 
     ImGui::SetNextItemWidth(200);
-    ImGui::Combo((std::string("mat") + idx).c_str(),
+    bool edited = ImGui::Combo((std::string("mat") + idx).c_str(),
         reinterpret_cast<int *>(&o->M), "Lambertian\0Metal\0Dielectric\0");
     ImGui::SameLine(); ImGui::SetNextItemWidth(100);
-    ImGui::InputDouble((std::string("radius") + idx).c_str(),
+    edited |= ImGui::InputDouble((std::string("radius") + idx).c_str(),
         &dynamic_cast<Sphere *>(o.get())->radius, 0.1, 0.05, "%.2lf");
     ImGui::SetNextItemWidth(100);
-    ImGui::InputDouble((std::string("x") + idx).c_str(),
+    edited |= ImGui::InputDouble((std::string("x") + idx).c_str(),
         &o->center.x(), 0.05, 0.05, "%.2lf");
     ImGui::SameLine(); ImGui::SetNextItemWidth(100);
-    ImGui::InputDouble((std::string("y") + idx).c_str(),
+    edited |= ImGui::InputDouble((std::string("y") + idx).c_str(),
         &o->center.y(), 0.1, 0.05, "%.2lf");
     ImGui::SameLine(); ImGui::SetNextItemWidth(100);
-    ImGui::InputDouble((std::string("z") + idx).c_str(),
+    edited |= ImGui::InputDouble((std::string("z") + idx).c_str(),
         &o->center.z(), 0.1, 0.05, "%.2lf");
+
+    return edited;
 }
 
 void showCameraControls(SDL_Surface *canvas)
@@ -240,17 +372,149 @@ void addRandomObject()
 
 void preview(SDL_Surface *canvas)
 {
-    if (SamplesPerPixel != 1)
-        SamplesPerPixelTmp = std::exchange(SamplesPerPixel, 1);
-    initiateRender(canvas);
+    initiateRender(canvas, true);
+}
+
+// Updates what depends on the camera and scene layout ahead of a render.
+void prepareScene()
+{
+    Camera.recalculate();
+    world.update();
+    tiles.build(Camera, world);
+    CullStats::reset();
+}
+
+// Drops everything that depends on the scene's content: the last image for
+// reprojection and the radiance cache. Bounds and tiles follow with the next
+// render's prepareScene().
+void sceneChanged()
+{
+    Reusable = false;
+    Edited = true;
+    cache.clear();
+}
+
+// Records the surface seen along a pixel's center ray; the renderer's workers
+// run this for every pixel as a render starts.
+void recordSurface(unsigned x, unsigned y)
+{
+    const auto r = Camera.getRay(x, y);
+    auto& s = Surfaces[y * Width + x];
+    if (const auto hit = world.hit(r, tiles.candidates(x, y), false); hit) {
+        const auto& [closest, object, index] = *hit;
+        s = {closest * r.direction().length(), object->M == Material::Lambertian};
+    }
+}
+
+// Carries samples of the last image, whose pixels saw `previous`, over to
+// pixels of the new camera that see the same diffuse surface point.
+// Reflections and refractions change with the viewpoint, so those pixels are
+// left for the renderer to fill, as are disoccluded ones.
+void reprojectHistory(std::vector<Surface> previous)
+{
+    renderer.reproject([previous = std::move(previous), last = LastCamera]
+        (unsigned x, unsigned y) -> std::optional<unsigned>
+    {
+        const auto r = Camera.getRay(x, y);
+        const auto& s = Surfaces[y * Width + x];
+        if (!s.diffuse)
+            return {};
+
+        // The sky only depends on direction.
+        if (std::isinf(s.depth)) {
+            const auto i = last.project(r.direction());
+            return i && std::isinf(previous[*i].depth) ? i : std::nullopt;
+        }
+
+        const auto v = Camera.origin + r.direction().normalize() * s.depth - last.origin;
+        const auto d = v.length();
+        const auto i = last.project(v);
+        return i && previous[*i].diffuse && std::abs(previous[*i].depth - d) < 0.01 * d ? i : std::nullopt;
+    }, HistoryCap);
 }
 
 void exportScreenshot(SDL_Surface *canvas)
 {
     std::string filename ("screenshot_");
     filename += std::to_string(int(randomN() * 1000000));
-    filename += ".png";
-    IMG_SavePNG(canvas, filename.c_str());
-    std::cout << "saved " << filename << std::endl;
+
+    // Files are written from copies on a thread of their own, so the UI keeps
+    // running and the renderer may carry on, even while earlier exports are
+    // still being written.
+    std::erase_if(exports, [](const auto& e) {
+        return e.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    });
+    exports.push_back(std::async(std::launch::async, [shot = SDL_DuplicateSurface(canvas), hdr = renderer.image(), filename] {
+        IMG_SavePNG(shot, (filename + ".png").c_str());
+        SDL_FreeSurface(shot);
+        std::cout << "saved " << filename << ".png" << std::endl;
+
+        if (hdr.size() == Width * Height * 3 && writePFM(filename + ".pfm", hdr.data(), Width, Height))
+            std::cout << "saved " << filename << ".pfm" << std::endl;
+    }));
 }
 
+// Renders to stdout as PPM without opening a window:
+// `--spp N` for a fixed sample count, `--budget S` for a time budget in seconds.
+// `--scaling N` instead reports render times of N samples for 1..all CPUs.
+int renderHeadless(std::string_view mode, const char *arg)
+{
+
+    if (mode == "--scaling")
+        return reportScaling(std::max(std::atoi(arg), 1));
+
+    prepareScene();
+    renderer.setBuffer(nullptr, Width, Height);
+    renderStart = std::chrono::high_resolution_clock::now();
+    if (mode == "--spp") {
+        renderer.start(samplePixel, threads, unsigned(std::max(std::atoi(arg), 1)));
+    } else if (mode == "--budget" && std::atof(arg) > 0) {
+        renderer.start(samplePixel, threads, std::chrono::duration<double>(std::atof(arg)));
+    } else {
+        std::cerr << "usage: main [--spp N | --budget SECONDS | --scaling N]" << std::endl;
+        return 1;
+    }
+
+    while (renderer)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    renderTime = std::chrono::high_resolution_clock::now() - renderStart;
+
+    std::cout << "P3\n" << Width << ' ' << Height << "\n255\n";
+    for (auto y : std::views::iota(0u, Height)) {
+        for (auto x : std::views::iota(0u, Width))
+            write_color(std::cout, renderer.at(x, y));
+    }
+
+    std::cerr << renderTime.count() << "s, " << renderer.samples() << " spp, culled "
+        << CullStats::primary() << " camera and " << CullStats::bounce()
+        << " bounce rays" << std::endl;
+    if (const auto over = renderer.overrun(); over.count() > 0)
+        std::cerr << "budget exceeded by " << over.count() << "s, as passes run to completion once started" << std::endl;
+    return 0;
+}
+
+int reportScaling(unsigned spp)
+{
+    const auto& topo = renderer.topology();
+    std::cout << topo.nodes.size() << " node(s), " << topo.cpus() << " CPU(s), "
+        << spp << " spp\nthreads\ttime\tspeedup\tefficiency\n";
+
+    prepareScene();
+    renderer.setBuffer(nullptr, Width, Height);
+
+    double base = 0;
+    for (auto n : std::views::iota(1u, topo.cpus() + 1)) {
+        renderStart = std::chrono::high_resolution_clock::now();
+        renderer.start(samplePixel, n, spp);
+        while (renderer)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        renderTime = std::chrono::high_resolution_clock::now() - renderStart;
+
+        if (n == 1)
+            base = renderTime.count();
+        const auto speedup = base / renderTime.count();
+        std::cout << n << '\t' << renderTime.count() << '\t' << speedup << '\t' << speedup / n << std::endl;
+    }
+
+    return 0;
+}
@@ -26,6 +26,12 @@ struct Object
 
     virtual std::pair<color, ray> scatter(const ray& r, double root) const = 0;
     virtual std::optional<double> hit(const ray& r, double tmin, double tmax) const = 0;
+    virtual vec3 normal(const point3& p) const = 0; // Outward, unit length
+    virtual double extent() const = 0; // Radius around center enclosing the object
+
+    // Whether `r`, starting on the surface, heads away without being able to
+    // hit the object again.
+    virtual bool escapes(const ray& r) const = 0;
 };
 
 #endif // OBJECT_H
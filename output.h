@@ -0,0 +1,127 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <ranges>
+#include <string>
+#include <vector>
+
+// Turns linear HDR color planes into display pixels. The loops work on
+// separate R, G and B planes in fixed-size blocks and are kept free of calls
+// and data-dependent branches so that they vectorize under -O3 -march=native.
+struct ToneMap
+{
+    enum class Curve : int {
+        SRGB = 0,
+        Gamma2, // Square root, as write_color() does
+    };
+
+    float exposure = 1.f;
+    Curve curve = Curve::SRGB;
+    bool aces = false;
+
+    // Packs `n` pixels as SDL_PIXELFORMAT_RGBA8888: red in the top byte,
+    // alpha opaque.
+    void operator()(const float *r, const float *g, const float *b,
+        std::uint32_t *out, std::size_t n) const
+    {
+        alignas(32) float c[3][Block];
+        alignas(32) std::uint8_t q[3][Block];
+
+        for (std::size_t first = 0; first < n; first += Block) {
+            const auto m = std::min(Block, n - first);
+            const float *planes[3] = {r + first, g + first, b + first};
+
+            for (auto k : std::views::iota(0, 3)) {
+                expose(planes[k], c[k], m);
+                encode(c[k], q[k], m);
+            }
+
+            for (std::size_t i = 0; i < m; ++i) {
+                out[first + i] = std::uint32_t(q[0][i]) << 24 | std::uint32_t(q[1][i]) << 16
+                    | std::uint32_t(q[2][i]) << 8 | 0xFF;
+            }
+        }
+    }
+
+private:
+    static constexpr std::size_t Block = 256;
+    static constexpr std::size_t TableSize = 8192;
+
+    // Scales by exposure, applies the ACES filmic fit if enabled and clamps
+    // to [0, 1].
+    void expose(const float *in, float *out, std::size_t m) const {
+        const auto e = exposure;
+        if (aces) {
+            for (std::size_t i = 0; i < m; ++i) {
+                const auto x = in[i] * e;
+                out[i] = saturate(x * (2.51f * x + 0.03f) / (x * (2.43f * x + 0.59f) + 0.14f));
+            }
+        } else {
+            for (std::size_t i = 0; i < m; ++i)
+                out[i] = saturate(in[i] * e);
+        }
+    }
+
+    // Clamps to [0, 1], mapping NaN to 0 so it can't index out of the tables.
+    static float saturate(float x) {
+        return std::min(std::max(0.f, x), 1.f);
+    }
+
+    // Encodes through a table lookup, which vectorizes as a gather where
+    // pow() or a checked sqrt() would not. Entries are 32 bits wide because
+    // there are no byte gathers.
+    void encode(const float *in, std::uint8_t *out, std::size_t m) const {
+        const auto& table = curve == Curve::Gamma2 ? gamma2Table() : srgbTable();
+        for (std::size_t i = 0; i < m; ++i)
+            out[i] = table[int(in[i] * (TableSize - 1) + 0.5f)];
+    }
+
+    // Samples `f` over [0, 1] finely enough to resolve every output byte near
+    // black.
+    static std::array<std::int32_t, TableSize> makeTable(auto f) {
+        std::array<std::int32_t, TableSize> t;
+        for (auto i : std::views::iota(0u, TableSize))
+            t[i] = std::int32_t(f(double(i) / (TableSize - 1)) * 255 + 0.5);
+        return t;
+    }
+
+    static const std::array<std::int32_t, TableSize>& srgbTable() {
+        static const auto table = makeTable([](double v) {
+            return v <= 0.0031308 ? 12.92 * v : 1.055 * std::pow(v, 1 / 2.4) - 0.055;
+        });
+        return table;
+    }
+
+    static const std::array<std::int32_t, TableSize>& gamma2Table() {
+        static const auto table = makeTable([](double v) { return std::sqrt(v); });
+        return table;
+    }
+};
+
+// Writes linear color planes losslessly as PFM, which stores rows bottom to
+// top; the sign of the scale gives the byte order.
+inline bool writePFM(const std::string& filename, const float *planes, unsigned w, unsigned h)
+{
+    std::ofstream out (filename, std::ios::binary);
+    out << "PF\n" << w << ' ' << h << '\n'
+        << (std::endian::native == std::endian::little ? "-1.0" : "1.0") << '\n';
+
+    std::vector<float> row (w * 3);
+    for (auto y : std::views::iota(0u, h) | std::views::reverse) {
+        for (auto x : std::views::iota(0u, w)) {
+            for (auto k : std::views::iota(0u, 3u))
+                row[x * 3 + k] = planes[k * w * h + y * w + x];
+        }
+        out.write(reinterpret_cast<const char *>(row.data()), row.size() * sizeof(float));
+    }
+
+    return bool(out);
+}
+
+#endif // OUTPUT_H
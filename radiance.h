@@ -0,0 +1,129 @@
+#ifndef RADIANCE_H
+#define RADIANCE_H
+
+#include "color.h"
+#include "vec3.h"
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <ranges>
+
+// World-space cache of light arriving at diffuse surfaces, hashed on a
+// uniform grid of cells split by the dominant axis of the surface normal.
+// Workers fill and read it concurrently without locks: entries are claimed
+// by compare-and-swap to a busy key, reset, and only then published under
+// their real key; they accumulate with atomic adds. Races can only lose a
+// sample, never corrupt an entry. clear() bumps a 32-bit generation number
+// stored in every key instead of wiping the table, so it is safe to call
+// while rendering; it would take 2^32 clears for old entries to come back.
+class RadianceCache
+{
+public:
+    RadianceCache(): entries(new Entry[Size]) {
+        setQuality(4);
+    }
+
+    // Higher quality means smaller cells that need more samples before they
+    // are used. Clears the cache.
+    void setQuality(int q) {
+        cellSize.store(0.25 / q);
+        minSamples.store(4 * q);
+        clear();
+    }
+
+    void clear() {
+        auto g = generation.load();
+        while (!generation.compare_exchange_weak(g, g + 1 ? g + 1 : 1))
+            ;
+    }
+
+    // Cell of a surface point. Jittering by up to half a cell trades the
+    // grid's blockiness for noise.
+    std::uint64_t key(const point3& p, const vec3& normal) const {
+        const auto size = cellSize.load(std::memory_order_relaxed);
+        const auto q = (p + (vec3::random() - vec3(0.5, 0.5, 0.5)) * size) / size;
+
+        int axis = 0;
+        for (int j : {1, 2}) {
+            if (std::fabs(normal[j]) > std::fabs(normal[axis]))
+                axis = j;
+        }
+
+        std::uint64_t h = axis * 2 + (normal[axis] < 0);
+        for (int j : {0, 1, 2})
+            h = h * 0x9E3779B97F4A7C15ull + std::uint64_t(std::int64_t(std::floor(q[j])));
+
+        // splitmix64 finalizer
+        h ^= h >> 30; h *= 0xBF58476D1CE4E5B9ull;
+        h ^= h >> 27; h *= 0x94D049BB133111EBull;
+        h ^= h >> 31;
+
+        return std::uint64_t(generation.load(std::memory_order_relaxed)) << 32 | (h & 0xFFFFFFFFull);
+    }
+
+    // Average incoming light in a cell, once enough samples were recorded.
+    std::optional<color> lookup(std::uint64_t key) const {
+        for (auto j : std::views::iota(0u, Probes)) {
+            const auto& e = entries[(key + j) & (Size - 1)];
+            const auto k = e.key.load(std::memory_order_acquire);
+            if (k == key) {
+                const auto n = e.count.load(std::memory_order_relaxed);
+                if (n < minSamples.load(std::memory_order_relaxed))
+                    return {};
+                return color(e.sum[0].load(), e.sum[1].load(), e.sum[2].load()) / n;
+            } else if (k == Busy || stale(k)) {
+                return {};
+            }
+        }
+
+        return {};
+    }
+
+    void record(std::uint64_t key, const color& light) {
+        for (auto j : std::views::iota(0u, Probes)) {
+            auto& e = entries[(key + j) & (Size - 1)];
+            auto k = e.key.load(std::memory_order_acquire);
+            if (k != Busy && stale(k) && e.key.compare_exchange_strong(k, Busy, std::memory_order_acquire)) {
+                for (auto& s : e.sum)
+                    s.store(0, std::memory_order_relaxed);
+                e.count.store(0, std::memory_order_relaxed);
+                e.key.store(key, std::memory_order_release);
+                k = key;
+            }
+
+            if (k == Busy) {
+                return; // Being reset by another thread
+            } else if (k == key) {
+                for (auto c : {0, 1, 2})
+                    e.sum[c].fetch_add(light[c], std::memory_order_relaxed);
+                e.count.fetch_add(1, std::memory_order_relaxed);
+                return;
+            }
+        }
+    }
+
+private:
+    static constexpr std::uint64_t Size = 1 << 17;
+    static constexpr unsigned Probes = 8;
+    static constexpr std::uint64_t Busy = 1; // Generation 0, which is never current
+
+    struct Entry {
+        std::atomic<std::uint64_t> key {0}; // Generation in the top 32 bits
+        std::atomic<float> sum[3] {};
+        std::atomic<std::uint32_t> count {0};
+    };
+
+    std::unique_ptr<Entry[]> entries;
+    std::atomic<std::uint32_t> generation {1};
+    std::atomic<double> cellSize;
+    std::atomic<std::uint32_t> minSamples;
+
+    bool stale(std::uint64_t key) const {
+        return key >> 32 != generation.load(std::memory_order_relaxed);
+    }
+};
+
+#endif // RADIANCE_H
@@ -5,8 +5,9 @@
 
 inline double randomN()
 {
-    static std::uniform_real_distribution<double> distribution (0.0, 1.0);
-    static std::mt19937 generator (std::random_device{}());
+    // Per thread, so render workers neither race on nor share its state.
+    thread_local std::uniform_real_distribution<double> distribution (0.0, 1.0);
+    thread_local std::mt19937 generator (std::random_device{}());
     return distribution(generator);
 }
 
@@ -1,34 +1,83 @@
 #ifndef RENDERER_H
 #define RENDERER_H
 
+#include "color.h"
+#include "output.h"
+#include "topology.h"
+
 #include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <numeric>
+#include <optional>
 #include <ranges>
 #include <thread>
+#include <utility>
+#include <vector>
 
+// Renders the image in full passes of one sample per pixel. A pass is only
+// committed to the pixel buffer once every pixel has received its sample, so
+// the buffer never shows a partial pass, even after stop().
+// Samples carried over by reproject() are kept per pixel, so pixel sample
+// counts then differ; pixels left without history are filled by an extra
+// pass before the regular ones. Until that pass is committed the buffer still
+// shows the previous image, also if stop() lands during it.
+//
+// A pool of workers is pinned one per CPU and kept across renders, and the
+// image is split into row bands, one per NUMA node. Phases that may be the
+// first to write a buffer's pages keep each worker to its own node's band;
+// tracing starts there too but lets workers help out elsewhere once done.
+//
+// Committing a pass only updates the linear HDR image; a separate output
+// stage then tone maps it into the pixel buffer.
 class Renderer
 {
 public:
-    template<typename Fn>
-    void start(Fn func, int tn) {
-        actives.store(tn);
-        processed.store(0);
-        Stop.store(false);
+    using clock = std::chrono::steady_clock;
 
-        if (primary.joinable())
-            primary.join();
+    // Renders exactly `spp` passes.
+    template<typename Fn>
+    void start(Fn func, int tn, unsigned spp) {
+        begin(func, tn, spp, clock::duration::max());
+    }
 
-        primary = std::thread(&Renderer::dispatchWorkers<Fn>, this, func);
+    // Renders as many passes as fit within the wall-clock `budget`.
+    template<typename Fn>
+    void start(Fn func, int tn, std::chrono::duration<double> budget) {
+        begin(func, tn, std::numeric_limits<unsigned>::max(),
+            std::chrono::duration_cast<clock::duration>(budget));
     }
 
+    // The pixel buffer is SDL_PIXELFORMAT_RGBA8888; a null buffer skips the
+    // output stage and keeps only the HDR image (see at() and image()).
     void setBuffer(std::uint32_t *pixelbuf, unsigned w, unsigned h) {
         pixelBuffer = pixelbuf;
         width = w;
         height = h;
     }
 
+    // Takes effect with the next committed pass, or with develop().
+    void setToneMap(const ToneMap& tm) {
+        std::scoped_lock lock (output);
+        toneMap = tm;
+    }
+
+    // Reruns the output stage on the committed image, e.g. after a tone
+    // mapping change. Does nothing while rendering, as the next committed
+    // pass picks up the change.
+    void develop() {
+        std::scoped_lock lock (output);
+        if (Stop.load() && pixelBuffer && hdr.size() == width * height * 3 && !pool.empty())
+            runOutput();
+    }
+
     ~Renderer() {
         stop();
+        release();
     }
 
     operator bool() const {
@@ -36,58 +85,343 @@ public:
     }
 
     unsigned progress() const {
-        return processed.load() * 100 / total;
+        if (budget != clock::duration::max()) {
+            const auto elapsed = clock::now() - startTime;
+            return std::min<unsigned>(elapsed * 100 / budget, 100);
+        }
+
+        return (passes.load() * total + processed.load()) * 100 / (target * total);
+    }
+
+    // How far a budgeted render finished past its budget. A started pass
+    // always runs to completion, so a budget shorter than a single pass is
+    // overrun by the first one.
+    std::chrono::duration<double> overrun() const {
+        if (!Stop.load() || budget == clock::duration::max())
+            return {};
+        return std::max(finishTime - startTime - budget, clock::duration::zero());
     }
 
-    void stop() {
+    // Fewest samples of any pixel in the committed image.
+    unsigned samples() const {
+        return fewest.load();
+    }
+
+    // Most samples of any pixel; more than samples() where history was reused.
+    unsigned mostSamples() const {
+        return most.load();
+    }
+
+    // Averaged color of a pixel in the committed image. After reproject(),
+    // only valid once the render has committed a pass.
+    color at(unsigned x, unsigned y) const {
+        const auto i = y * width + x;
+        return counts[i] ? accum[i] / counts[i] : color();
+    }
+
+    // Copy of the committed linear image as R, G and B planes.
+    std::vector<float> image() const {
+        std::scoped_lock lock (output);
+        return std::vector<float>(hdr.get(), hdr.get() + hdr.size());
+    }
+
+    const Topology& topology() const {
+        return topo;
+    }
+
+    // Calls `fn(x, y)` once per pixel on the workers as the next start()
+    // begins, ahead of the reproject() source for the same pixel.
+    void survey(std::function<void(unsigned, unsigned)> fn) {
+        visitor = std::move(fn);
+    }
+
+    // Carries the current image over to the next start(): `source(x, y)` names
+    // the pixel of the current image to reuse for (x, y), if any. It is called
+    // once per pixel by the workers as the render starts. History is capped at
+    // `cap` samples so that new samples can take over. Only valid while
+    // stopped; history is dropped if the buffer size changed.
+    void reproject(std::function<std::optional<unsigned>(unsigned, unsigned)> fn, unsigned cap) {
+        source = std::move(fn);
+        historyCap = cap;
+        carried = counts.size() == width * height;
+    }
+
+    // Aborts the pass in flight; returns the fewest samples per pixel achieved.
+    unsigned stop() {
         Stop.store(true);
         if (primary.joinable())
             primary.join();
+        return samples();
     }
 
 private:
+    static constexpr auto None = std::numeric_limits<unsigned>::max();
+
     std::uint32_t *pixelBuffer = nullptr;
-    unsigned width = 0, height = 0, total = 0;
+    ToneMap toneMap;
+    mutable std::mutex output; // Guards toneMap, hdr and pixelBuffer contents
+    Untouched<color> accum, history, sample;
+    Untouched<float> hdr;
+    Untouched<unsigned> counts, historyCounts;
+    std::function<void(unsigned, unsigned)> visitor;
+    std::function<std::optional<unsigned>(unsigned, unsigned)> source;
+    unsigned historyCap = 0;
+    Topology topo = Topology::detect();
+    std::vector<Topology::Slot> slots;
+    std::vector<unsigned> bands; // First chunk of each node's band
+    unsigned width = 0, height = 0, total = 1, target = 1, chunkSize = 1;
+    clock::duration budget = clock::duration::max();
+    clock::time_point startTime, finishTime;
     std::thread primary;
-    std::atomic_uint actives;
+    std::vector<std::thread> pool;
+    std::vector<std::atomic_uint> next; // Next chunk of each node's band
+    std::mutex phases; // Serializes runPhase()
+    std::mutex jobs;   // Guards the fields below
+    std::condition_variable wake, idle;
+    std::function<void(unsigned, unsigned)> job;
+    unsigned phase = 0, busy = 0;
+    bool steal = false;
+    bool quit = false;
     std::atomic_uint processed;
-    std::atomic_bool Stop;
+    std::atomic_uint passes;
+    std::atomic_uint fewest, most;
+    std::atomic_bool Stop {true};
+    std::atomic_bool holes, kept;
+    bool carried = false;
+    bool filling = false;
 
     template<typename Fn>
-    void dispatchWorkers(Fn func) {
-        const auto N = actives.load();
+    void begin(Fn func, unsigned N, unsigned spp, clock::duration limit) {
+        stop();
+
+        // Nothing to render; progress() also relies on both being positive.
+        if (spp == 0 || limit <= clock::duration::zero())
+            return;
+
+        const auto size = width * height;
+        filling = std::exchange(carried, false);
+        if (filling) {
+            std::swap(accum, history);
+            std::swap(counts, historyCounts);
+        }
+
+        // Pages are placed for a worker layout, so a new layout starts over.
+        if (slots.size() != N) {
+            history = {};
+            historyCounts = {};
+            filling = false;
+        }
+        if (accum.size() != size || slots.size() != N) {
+            accum = Untouched<color>(size);
+            counts = Untouched<unsigned>(size);
+            sample = Untouched<color>(size);
+        }
+
+        // The committed image must outlive the swaps above until the next
+        // commit, so that develop() and image() keep working if stopped early.
+        if (hdr.size() != size * 3)
+            hdr = Untouched<float>(size * 3);
+
+        slots = topo.place(N);
         total = N * 16;
-        auto threads = std::views::transform(
-            std::views::chunk(
-                std::views::cartesian_product(
-                    std::views::iota(0u, width),
-                    std::views::iota(0u, height)),
-                width * height / total),
-            [=, this](auto chunk) { return std::thread([=, this] { worker(func, chunk); }); });
-
-        for (auto th : threads) {
-            while (actives.load() == 0)
-                std::this_thread::yield();
-            --actives;
-            th.detach();
+        chunkSize = (size + total - 1) / total;
+        bands.assign(topo.nodes.size() + 1, 0);
+        for (auto slot : slots)
+            bands[slot.node + 1] += 16;
+        std::partial_sum(bands.begin(), bands.end(), bands.begin());
+        next = std::vector<std::atomic_uint>(bands.size() - 1);
+
+        if (pool.size() != slots.size()) {
+            release();
+            for (auto slot : slots)
+                pool.emplace_back(&Renderer::work, this, slot, phase);
         }
 
-        while (actives.load() < N)
-            std::this_thread::yield();
-        Stop.store(true);
+        target = spp;
+        budget = limit;
+        processed.store(0);
+        passes.store(0);
+        fewest.store(0);
+        most.store(0);
+        Stop.store(false);
+
+        startTime = clock::now();
+        primary = std::thread(&Renderer::dispatchPasses<Fn>, this, func);
     }
 
-    void worker(auto func, auto chunk) {
-        for (auto [x, y] : chunk) {
+    template<typename Fn>
+    void dispatchPasses(Fn func) {
+        prepare();
+        visitor = nullptr;
+        source = nullptr;
+        filling = filling && holes.load() && kept.load();
+
+        if (filling) {
+            dispatchWorkers(func);
+            if (!Stop.load())
+                commit();
+            filling = false;
+        }
+
+        while (!Stop.load() && passes.load() < target) {
+            const auto passStart = clock::now();
+            dispatchWorkers(func);
             if (Stop.load())
+                break; // Partial pass is discarded.
+
+            commit();
+
+            // Don't start a pass that is not expected to finish in time.
+            const auto now = clock::now();
+            if ((now - startTime) + (now - passStart) > budget)
                 break;
-            pixelBuffer[y * width + x] = func(x, y);
         }
 
-        ++processed;
-        ++actives;
+        finishTime = clock::now();
+        Stop.store(true);
+    }
+
+    // Runs `body(first, last)` once for every chunk of pixel indices on the
+    // pool. Each worker drains its own node's band first; with `stealing` it
+    // then moves on to the others. Phases that may first-touch a buffer must
+    // not steal, or pages would land on whichever node got there first.
+    void runPhase(std::function<void(unsigned, unsigned)> body, bool stealing) {
+        std::scoped_lock serial (phases);
+        for (auto n : std::views::iota(0u, unsigned(next.size())))
+            next[n].store(bands[n]);
+
+        std::unique_lock lock (jobs);
+        job = std::move(body);
+        steal = stealing;
+        busy = pool.size();
+        ++phase;
+        wake.notify_all();
+        idle.wait(lock, [this] { return busy == 0; });
+    }
+
+    void work(Topology::Slot slot, unsigned seen) {
+        Topology::pin(slot.cpu);
+
+        for (std::unique_lock lock (jobs);;) {
+            wake.wait(lock, [&] { return phase != seen; });
+            if (quit)
+                return;
+            seen = phase;
+            lock.unlock();
+
+            const unsigned nodes = next.size();
+            const auto size = width * height;
+            for (auto j : std::views::iota(0u, steal ? nodes : 1u)) {
+                const auto n = (slot.node + j) % nodes;
+                for (unsigned k; (k = next[n]++) < bands[n + 1];)
+                    job(std::min(k * chunkSize, size), std::min((k + 1) * chunkSize, size));
+            }
+
+            lock.lock();
+            if (--busy == 0)
+                idle.notify_one();
+        }
+    }
+
+    // Shuts the pool down; only while stopped.
+    void release() {
+        {
+            std::scoped_lock lock (jobs);
+            quit = true;
+            ++phase;
+        }
+        wake.notify_all();
+
+        for (auto& w : pool)
+            w.join();
+        pool.clear();
+        quit = false;
+    }
+
+    // Clears the accumulator, or fills it from reprojected history. This is
+    // the first phase to write the buffers, so it also touches the samples.
+    void prepare() {
+        holes.store(false);
+        kept.store(false);
+        runPhase([this](auto first, auto last) {
+            for (auto i : std::views::iota(first, last)) {
+                if (visitor)
+                    visitor(i % width, i / width);
+                const auto src = source ? source(i % width, i / width).value_or(None) : None;
+                sample[i] = color();
+                if (filling && src != None && historyCounts[src]) {
+                    const auto n = std::min(historyCounts[src], historyCap);
+                    accum[i] = history[src] * (double(n) / historyCounts[src]);
+                    counts[i] = n;
+                    kept.store(true, std::memory_order_relaxed);
+                } else {
+                    accum[i] = color();
+                    counts[i] = 0;
+                    holes.store(true, std::memory_order_relaxed);
+                }
+            }
+        }, false);
+    }
+
+    template<typename Fn>
+    void dispatchWorkers(Fn func) {
+        runPhase([this, &func](auto first, auto last) {
+            for (auto i : std::views::iota(first, last)) {
+                if (Stop.load())
+                    break;
+                if (!filling || counts[i] == 0)
+                    sample[i] = func(i % width, i / width);
+            }
+
+            ++processed;
+        }, true);
+    }
+
+    void commit() {
+        std::scoped_lock lock (output);
+        const auto size = width * height;
+        std::atomic_uint lowest = std::numeric_limits<unsigned>::max(), highest = 0;
+        runPhase([&, this](auto first, auto last) {
+            auto lo = std::numeric_limits<unsigned>::max(), hi = 0u;
+            for (auto i : std::views::iota(first, last)) {
+                if (!filling || counts[i] == 0) {
+                    accum[i] += sample[i];
+                    ++counts[i];
+                }
+
+                const auto c = accum[i] / counts[i];
+                hdr[i] = c.x();
+                hdr[size + i] = c.y();
+                hdr[size * 2 + i] = c.z();
+                lo = std::min(lo, counts[i]);
+                hi = std::max(hi, counts[i]);
+            }
+
+            for (auto seen = lowest.load(); lo < seen && !lowest.compare_exchange_weak(seen, lo);)
+                ;
+            for (auto seen = highest.load(); hi > seen && !highest.compare_exchange_weak(seen, hi);)
+                ;
+        }, false);
+
+        fewest.store(lowest.load());
+        most.store(highest.load());
+
+        if (pixelBuffer)
+            runOutput();
+
+        processed.store(0);
+        if (!filling)
+            ++passes;
+    }
+
+    // Tone maps the HDR image into the pixel buffer; `output` must be held.
+    void runOutput() {
+        const auto size = width * height;
+        runPhase([this, size](auto first, auto last) {
+            const auto *planes = hdr.get() + first;
+            toneMap(planes, planes + size, planes + size * 2, pixelBuffer + first, last - first);
+        }, false);
     }
 };
 
 #endif // RENDERER_H
-
@@ -19,7 +19,7 @@ struct Sphere : public Object
 
     std::pair<color, ray> scatter(const ray& r, double root) const override {
         const auto p = r.at(root);
-        auto normal = (p - center) / radius;
+        auto normal = this->normal(p);
 
         if (M == Material::Lambertian) {
             return {tint, ray(p, normal + randomUnitSphere())};
@@ -46,6 +46,19 @@ struct Sphere : public Object
         }
     }
 
+    vec3 normal(const point3& p) const override {
+        return (p - center) / radius;
+    }
+
+    double extent() const override {
+        return std::fabs(radius);
+    }
+
+    // Spheres are convex, so any ray pointing outward escapes.
+    bool escapes(const ray& r) const override {
+        return r.direction().dot(r.origin() - center) > 0;
+    }
+
     std::optional<double> hit(const ray& r, double tmin, double tmax) const override {
         const vec3 oc = center - r.origin();
         const auto a = r.direction().length_squared();
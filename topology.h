@@ -0,0 +1,183 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#endif
+
+// CPUs grouped by NUMA node, as read from /sys on Linux. Elsewhere, or when
+// /sys is unavailable, all CPUs are reported as a single node.
+struct Topology
+{
+    struct Slot {
+        unsigned cpu;
+        unsigned node; // Index into nodes
+    };
+
+    std::vector<std::vector<unsigned>> nodes;
+
+    static Topology detect() {
+        Topology topo;
+
+#ifdef __linux__
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        const bool masked = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+        // Node numbers may have gaps, e.g. for offline nodes.
+        std::ifstream online ("/sys/devices/system/node/online");
+        std::string ids;
+        std::getline(online, ids);
+        for (auto n : parseList(ids)) {
+            std::ifstream file ("/sys/devices/system/node/node" + std::to_string(n) + "/cpulist");
+            std::string list;
+            if (!std::getline(file, list))
+                continue;
+
+            auto cpus = parseList(list);
+            std::erase_if(cpus, [&](auto c) { return masked && !CPU_ISSET(c, &allowed); });
+            if (cpus.empty())
+                continue;
+
+            // Put the first hardware thread of each core ahead of its siblings.
+            std::ranges::stable_partition(cpus, [](auto c) {
+                std::ifstream file ("/sys/devices/system/cpu/cpu" + std::to_string(c) + "/topology/thread_siblings_list");
+                std::string list;
+                const auto siblings = std::getline(file, list) ? parseList(list) : std::vector<unsigned>();
+                return siblings.empty() || siblings.front() == c;
+            });
+            topo.nodes.push_back(std::move(cpus));
+        }
+#endif
+
+        if (topo.nodes.empty()) {
+            auto& cpus = topo.nodes.emplace_back();
+#ifdef __linux__
+            for (unsigned c = 0; masked && c < CPU_SETSIZE; ++c) {
+                if (CPU_ISSET(c, &allowed))
+                    cpus.push_back(c);
+            }
+#endif
+            if (cpus.empty()) {
+                for (unsigned c = 0; c < std::max(std::thread::hardware_concurrency(), 1u); ++c)
+                    cpus.push_back(c);
+            }
+        }
+
+        return topo;
+    }
+
+    unsigned cpus() const {
+        unsigned n = 0;
+        for (const auto& node : nodes)
+            n += node.size();
+        return n;
+    }
+
+    // Spreads `n` workers over the nodes round-robin, one CPU each, wrapping
+    // around when there are more workers than CPUs.
+    std::vector<Slot> place(unsigned n) const {
+        std::vector<Slot> slots;
+        std::vector<unsigned> used (nodes.size());
+        const auto all = cpus();
+
+        for (unsigned i = 0; slots.size() < n; ++i) {
+            const unsigned node = i % nodes.size();
+            const auto& list = nodes[node];
+            if (used[node] < list.size() || slots.size() >= all)
+                slots.push_back({list[used[node]++ % list.size()], node});
+        }
+
+        return slots;
+    }
+
+    // Pins the calling thread to `cpu`.
+    static void pin(unsigned cpu) {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+    }
+
+private:
+    // Parses a kernel CPU list such as "0-7,16-23".
+    static std::vector<unsigned> parseList(const std::string& list) {
+        std::vector<unsigned> cpus;
+        for (const char *p = list.c_str(); *p;) {
+            char *end;
+            const auto first = std::strtoul(p, &end, 10);
+            auto last = first;
+            if (end == p)
+                break;
+            if (*end == '-')
+                last = std::strtoul(end + 1, &end, 10);
+            for (auto c = first; c <= last; ++c)
+                cpus.push_back(c);
+            p = *end == ',' ? end + 1 : end;
+        }
+
+        return cpus;
+    }
+};
+
+// Storage for `n` T's whose pages are not touched on allocation, so that the
+// kernel places each page on the node of the thread that first writes it.
+template<typename T>
+class Untouched
+{
+public:
+    Untouched() = default;
+
+    explicit Untouched(std::size_t n_): n(n_), data(allocate(n_)) {}
+
+    T *get() const { return data.get(); }
+    std::size_t size() const { return n; }
+    T& operator[](std::size_t i) const { return data[i]; }
+
+private:
+    struct Release {
+        std::size_t n;
+        void operator()(T *p) const {
+#ifdef __linux__
+            munmap(p, n * sizeof(T));
+#else
+            std::free(p);
+#endif
+        }
+    };
+
+    std::size_t n = 0;
+    std::unique_ptr<T[], Release> data {nullptr, Release {0}};
+
+    static std::unique_ptr<T[], Release> allocate(std::size_t n) {
+        if (n == 0)
+            return {nullptr, Release {0}};
+
+#ifdef __linux__
+        void *p = mmap(nullptr, n * sizeof(T), PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            throw std::bad_alloc();
+#else
+        void *p = std::calloc(n, sizeof(T));
+        if (!p)
+            throw std::bad_alloc();
+#endif
+        return {static_cast<T *>(p), Release {n}};
+    }
+};
+
+#endif // TOPOLOGY_H
@@ -5,6 +5,7 @@
 #include "vec3.h"
 
 #include <cmath>
+#include <optional>
 
 struct View
 {
@@ -23,6 +24,8 @@ struct View
     vec3 pixelDY;
     vec3 viewportUL;
     vec3 pixelUL;
+    point3 origin;
+    vec3 forward;
 
     View() {
         recalculate();
@@ -44,6 +47,23 @@ struct View
         pixelDY = viewportY / Height;
         viewportUL = camera - focalLength * w - viewportX / 2 - viewportY / 2;
         pixelUL = viewportUL + 0.5 * (pixelDX + pixelDY);
+        origin = camera;
+        forward = -w;
+    }
+
+    // Index of the pixel seen along `dir` from the camera, if it is on screen.
+    std::optional<unsigned> project(const vec3& dir) const {
+        const auto z = dir.dot(forward);
+        if (z <= 0)
+            return {};
+
+        const auto p = origin + dir * (focalLength / z) - viewportUL;
+        const auto x = std::lround(p.dot(pixelDX) / pixelDX.length_squared() - 0.5);
+        const auto y = std::lround(p.dot(pixelDY) / pixelDY.length_squared() - 0.5);
+        if (x < 0 || y < 0 || x >= Width || y >= Height)
+            return {};
+
+        return y * Width + x;
     }
 
     ray getRay(int x, int y, bool addRandom = false) const {
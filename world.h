@@ -3,38 +3,191 @@
 
 #include "sphere.h"
 
+#include <array>
+#include <atomic>
+#include <cmath>
 #include <limits>
 #include <memory>
 #include <optional>
+#include <ranges>
+#include <span>
 #include <tuple>
 #include <vector>
 
+// Axis-aligned bounding box; empty until something is added.
+struct Box
+{
+    point3 min {std::numeric_limits<double>::infinity(),
+                std::numeric_limits<double>::infinity(),
+                std::numeric_limits<double>::infinity()};
+    point3 max {-std::numeric_limits<double>::infinity(),
+                -std::numeric_limits<double>::infinity(),
+                -std::numeric_limits<double>::infinity()};
+
+    void add(const point3& center, double extent) {
+        for (int i : {0, 1, 2}) {
+            min[i] = std::fmin(min[i], center[i] - extent);
+            max[i] = std::fmax(max[i], center[i] + extent);
+        }
+    }
+
+    void add(const Box& b) {
+        for (int i : {0, 1, 2}) {
+            min[i] = std::fmin(min[i], b.min[i]);
+            max[i] = std::fmax(max[i], b.max[i]);
+        }
+    }
+
+    // Slab test. Comparisons are written so that the NaNs of axis-parallel
+    // rays leave the interval alone.
+    bool hit(const ray& r, double tmin, double tmax) const {
+        for (int i : {0, 1, 2}) {
+            const auto inv = 1 / r.direction()[i];
+            auto t0 = (min[i] - r.origin()[i]) * inv;
+            auto t1 = (max[i] - r.origin()[i]) * inv;
+            if (inv < 0)
+                std::swap(t0, t1);
+            if (t0 > tmin)
+                tmin = t0;
+            if (t1 < tmax)
+                tmax = t1;
+            if (tmax < tmin)
+                return false;
+        }
+
+        return true;
+    }
+};
+
+// Rays rejected before testing any object since the last reset(). Each
+// thread counts into a cache line of its own, so counting stays cheap and
+// the totals are current at any time, whichever threads did the work.
+struct CullStats
+{
+    static void countPrimary() {
+        local().primary.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static void countBounce() {
+        local().bounce.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static unsigned long primary() {
+        return total(&Shard::primary);
+    }
+
+    static unsigned long bounce() {
+        return total(&Shard::bounce);
+    }
+
+    static void reset() {
+        for (auto& s : shards) {
+            s.primary.store(0);
+            s.bounce.store(0);
+        }
+    }
+
+private:
+    struct alignas(64) Shard {
+        std::atomic_ulong primary; // Camera rays in tiles that see nothing
+        std::atomic_ulong bounce;  // Other rays missing the bounds
+    };
+
+    static inline std::array<Shard, 64> shards;
+    static inline std::atomic_uint assigned;
+
+    static Shard& local() {
+        thread_local Shard& shard = shards[assigned++ % shards.size()];
+        return shard;
+    }
+
+    static unsigned long total(std::atomic_ulong Shard::*counter) {
+        unsigned long n = 0;
+        for (const auto& s : shards)
+            n += (s.*counter).load(std::memory_order_relaxed);
+        return n;
+    }
+};
+
 struct World
 {
+    using Hit = std::tuple<double, Object *, unsigned>; // Distance, object, index
+
     std::vector<std::unique_ptr<Object>> objects;
 
     template<class T>
     void add(auto&&... args) {
         objects.emplace_back(new T(args...));
+        update();
+    }
+
+    // Recomputes the bounding boxes; call after objects change.
+    void update() {
+        const auto n = objects.size();
+        std::vector<Box> after (n + 1);
+        for (auto i = n; i-- > 0;) {
+            after[i] = after[i + 1];
+            after[i].add(objects[i]->center, objects[i]->extent());
+        }
+
+        bounds = after[0];
+        others.resize(n);
+        Box before;
+        for (auto i : std::views::iota(std::size_t(0), n)) {
+            others[i] = before;
+            others[i].add(after[i + 1]);
+            before.add(objects[i]->center, objects[i]->extent());
+        }
     }
 
-    std::optional<std::pair<double, Object *>> hit(const ray& r) const {
+    // Closest hit of any object. `from` names an object the ray is leaving
+    // for good (see Object::escapes()), so that only the others are tested.
+    std::optional<Hit> hit(const ray& r, std::optional<unsigned> from = {}) const {
+        const auto& box = from && *from < others.size() ? others[*from] : bounds;
+        if (!box.hit(r, 0.001, std::numeric_limits<double>::infinity())) {
+            CullStats::countBounce();
+            return {};
+        }
+
+        return closest(r, std::views::iota(0u, unsigned(objects.size())), from);
+    }
+
+    // Closest hit among `candidates`, e.g. those a camera tile can see. Only
+    // `counted` rays add to CullStats, so that probes don't inflate them.
+    std::optional<Hit> hit(const ray& r, std::span<const unsigned> candidates, bool counted = true) const {
+        if (candidates.empty()) {
+            if (counted)
+                CullStats::countPrimary();
+            return {};
+        }
+
+        return closest(r, candidates, {});
+    }
+
+private:
+    Box bounds;
+    std::vector<Box> others; // Bounds of all objects but the one at each index
+
+    std::optional<Hit> closest(const ray& r, auto&& indices, std::optional<unsigned> skip) const {
         double closest = std::numeric_limits<double>::infinity();
-        Object *sphere;
+        Object *sphere = nullptr;
+        unsigned index = 0;
 
-        for (const auto& o : objects) {
-            if (auto t = o->hit(r, 0.001, closest); t) {
+        for (auto i : indices) {
+            if (i == skip || i >= objects.size())
+                continue;
+            if (auto t = objects[i]->hit(r, 0.001, closest); t) {
                 closest = *t;
-                sphere = o.get();
+                sphere = objects[i].get();
+                index = i;
             }
         }
 
         if (closest != std::numeric_limits<double>::infinity())
-            return std::pair {closest, sphere};
+            return Hit {closest, sphere, index};
         else
             return {};
     }
 };
 
 #endif // WORLD_H
-